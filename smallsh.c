@@ -13,6 +13,7 @@
 #include <limits.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <sys/mman.h>
 
 // Global variable to set state for SIGTSTP
 bool allowBG = true;
@@ -26,6 +27,32 @@ struct commandLine {
     bool isBackground; // Boolean to detect ampersand
 };
 
+/* Struct for a single entry of the command history */
+struct historyEntry {
+    const char *line; // Command text. Not null terminated
+    size_t length; // Length of the command text
+    long startTime; // Seconds since the epoch when the command was entered
+    long durationMs; // Time the command took in milliseconds
+    int exitStatus; // Exit value of the command, 128 + signal number if it was killed,
+                    // 1 for a failed builtin or -1 for a background command
+};
+
+/* Struct for the on-disk command history and its prefix index */
+struct history {
+    int fd; // History log opened for appending
+    char *map; // Read only mapping of the log as it was at startup
+    size_t mapSize;
+    size_t logSize; // Smallest size the log can have: the mapping plus what this shell appended
+    bool indexed; // Set once the mapped log has been parsed and indexed
+    struct historyEntry *logEntries; // Entries parsed from the mapped log
+    long logCount;
+    long *sorted; // Log entry numbers ordered by command text
+    long *newestTree; // Segment tree of the newest entry number over sorted
+    struct historyEntry *sessionEntries; // Entries added by this shell
+    long sessionCount;
+    long sessionCapacity;
+};
+
 /*
 * Frees the memory in the command line struct
 */
@@ -64,9 +91,10 @@ void printStatus(int status) {
 /*
 * Changes the current directory to the directory specified
 * by the path string. If path is NULL, current directory 
-* will be changed to HOME environment variable
+* will be changed to HOME environment variable.
+* Returns 0 on success and 1 if the directory could not be changed
 */
-void cdToPath(char* path) {
+int cdToPath(char* path) {
     // Initializes buffer
     char cwd[PATH_MAX + 1];
 
@@ -79,9 +107,11 @@ void cdToPath(char* path) {
     if (chdir(path) != 0) {
         perror("\nError: ");
         fflush(stdout);
+        return 1;
     }
     // Checks the cwd after chdir is invoked
     getcwd(cwd, PATH_MAX + 1);
+    return 0;
 }
 
 /*
@@ -177,7 +207,8 @@ bool nonBuiltCommand(struct commandLine *cmdLine) {
     // Returns true if it is not one of the built in commands
     if ((strcmp(cmdLine->command, "exit") != 0) && \
         (strcmp(cmdLine->command, "cd") !=  0) && \
-        (strcmp(cmdLine->command, "status") != 0)
+        (strcmp(cmdLine->command, "status") != 0) && \
+        (strcmp(cmdLine->command, "history") != 0)
     ) {
         return true;
     }
@@ -255,9 +286,11 @@ void handle_SIGTSTP(int signo) {
 }
 
 /*
-* Runs the non built in commands for the shell 
+* Runs the non built in commands for the shell. Returns the exit value of
+* a foreground command, 128 + the signal number if it was killed by a
+* signal, or -1 for a background command whose result is not yet known
 */
-void runCommand(struct commandLine *cmdLine, int* bgArr, int*childArr, int *status, void (*func)(int signo)) {
+int runCommand(struct commandLine *cmdLine, int* bgArr, int*childArr, int *status, void (*func)(int signo)) {
 
     char *newargv[514];
     char **newArgPtr = newargv;
@@ -265,6 +298,7 @@ void runCommand(struct commandLine *cmdLine, int* bgArr, int*childArr, int *stat
     pid_t childPid = -5;
     pid_t waitChildPID ;
     int childStatus;
+    int commandStatus = -1;
     int in;
     int out;
     // Initialize default action struct
@@ -387,9 +421,11 @@ void runCommand(struct commandLine *cmdLine, int* bgArr, int*childArr, int *stat
                 // Sets the status if child terminated normally
                 if (WIFEXITED(childStatus)) {
                     *status = WEXITSTATUS(childStatus);
+                    commandStatus = *status;
                 // Child process terminates abnormally.
                 }else if (WIFSIGNALED(childStatus)) {
                     printf("terminated by signal %d\n", WTERMSIG(childStatus));
+                    commandStatus = 128 + WTERMSIG(childStatus);
                 }
             }
     }
@@ -399,6 +435,7 @@ void runCommand(struct commandLine *cmdLine, int* bgArr, int*childArr, int *stat
         free(*newArgPtr);
         newArgPtr++;
     }
+    return commandStatus;
 }
 
 /*
@@ -577,6 +614,458 @@ struct commandLine *parseCommandLine(char *line) {
 }
 
 
+/*
+* Opens the history log and maps its current contents into memory.
+* The log is named by SMALLSH_HISTFILE or defaults to ~/.smallsh_history.
+* Parsing is deferred until the history is first searched so that
+* startup time does not grow with the size of the log
+*/
+void openHistory(struct history *hist) {
+    char path[PATH_MAX + 1];
+    struct stat fileInfo;
+    char *fileName = getenv("SMALLSH_HISTFILE");
+
+    memset(hist, 0, sizeof(struct history));
+    hist->fd = -1;
+    hist->map = NULL;
+
+    // Falls back to the HOME directory when no file is specified
+    if (fileName == NULL) {
+        if (getenv("HOME") == NULL) {
+            return;
+        }
+        snprintf(path, sizeof(path), "%s/.smallsh_history", getenv("HOME"));
+        fileName = path;
+    }
+
+    // Children of the shell should not inherit the log
+    hist->fd = open(fileName, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (hist->fd == -1) {
+        perror(fileName);
+        fflush(stdout);
+        return;
+    }
+
+    // mmap fails on an empty file so only map when there is something to read
+    if (fstat(hist->fd, &fileInfo) == 0 && fileInfo.st_size > 0) {
+        hist->map = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_PRIVATE, hist->fd, 0);
+        if (hist->map == MAP_FAILED) {
+            perror("mmap");
+            fflush(stdout);
+            hist->map = NULL;
+        } else {
+            hist->mapSize = fileInfo.st_size;
+            hist->logSize = fileInfo.st_size;
+        }
+    }
+
+    // Terminates a partial record left by a crash so the next record starts on its own line
+    if (hist->map != NULL && hist->map[hist->mapSize - 1] != '\n') {
+        if (write(hist->fd, "\n", 1) == -1) {
+            perror("history");
+            fflush(stdout);
+        } else {
+            hist->logSize++;
+        }
+    }
+}
+
+/*
+* Parses one record of the history log into entry. A record has the form
+* "start<TAB>duration<TAB>status<TAB>command" and end points to its newline.
+* Returns false if the record is malformed
+*/
+bool parseHistoryRecord(char *record, char *end, struct historyEntry *entry) {
+    char *field = record;
+    char *next;
+    long values[3];
+
+    for (int i = 0; i < 3; i++) {
+        // strtol skips whitespace, which could run past the newline
+        if (field >= end || !(isdigit((unsigned char) *field) || *field == '-')) {
+            return false;
+        }
+        values[i] = strtol(field, &next, 10);
+        if (next == field || next >= end || *next != '\t') {
+            return false;
+        }
+        field = next + 1;
+    }
+
+    entry->startTime = values[0];
+    entry->durationMs = values[1];
+    entry->exitStatus = (int) values[2];
+    entry->line = field;
+    entry->length = end - field;
+    return true;
+}
+
+/*
+* Orders log entry numbers by command text. Equal commands are kept
+* in the order they were run
+*/
+int compareHistoryEntries(const void *a, const void *b, void *arg) {
+    struct historyEntry *entries = arg;
+    struct historyEntry *first = &entries[*(const long *) a];
+    struct historyEntry *second = &entries[*(const long *) b];
+    size_t length = first->length < second->length ? first->length : second->length;
+    int result = memcmp(first->line, second->line, length);
+
+    if (result != 0) {
+        return result;
+    }
+    if (first->length != second->length) {
+        return first->length < second->length ? -1 : 1;
+    }
+    return (*(const long *) a > *(const long *) b) - (*(const long *) a < *(const long *) b);
+}
+
+/*
+* Compares the start of an entry's command with prefix. Returns 0 when
+* the command begins with prefix
+*/
+int comparePrefix(struct historyEntry *entry, const char *prefix, size_t prefixLength) {
+    size_t length = entry->length < prefixLength ? entry->length : prefixLength;
+    int result = memcmp(entry->line, prefix, length);
+
+    if (result != 0) {
+        return result;
+    }
+    return entry->length < prefixLength ? -1 : 0;
+}
+
+/*
+* Drops the mapping and everything indexed from it if the log has been
+* truncated since startup. Reading a mapped page past the end of the file
+* raises SIGBUS, so this must be checked before the mapping is read. The
+* size is compared with logSize rather than mapSize since records appended
+* after a truncation could otherwise hide it
+*/
+void checkHistoryMapping(struct history *hist) {
+    struct stat fileInfo;
+
+    if (hist->map == NULL || (fstat(hist->fd, &fileInfo) == 0 && (size_t) fileInfo.st_size >= hist->logSize)) {
+        return;
+    }
+
+    munmap(hist->map, hist->mapSize);
+    hist->map = NULL;
+    hist->mapSize = 0;
+    free(hist->logEntries);
+    free(hist->sorted);
+    free(hist->newestTree);
+    hist->logEntries = NULL;
+    hist->sorted = NULL;
+    hist->newestTree = NULL;
+    hist->logCount = 0;
+}
+
+/*
+* Parses the mapped log and builds the prefix index over it. The index is
+* an array of entry numbers sorted by command, so the entries sharing a
+* prefix form one contiguous range. A segment tree over that array gives
+* the newest entry in any range in O(log n). The index is kept in memory
+* only, so the first lookup of each session parses and sorts the whole log
+* in O(n log n)
+*/
+void indexHistory(struct history *hist) {
+    char *mapEnd;
+    char *record;
+    char *end;
+    long lines = 0;
+    long count = 0;
+
+    // Runs on every lookup since entries read from the mapping are only safe while it is valid
+    checkHistoryMapping(hist);
+    if (hist->indexed) {
+        return;
+    }
+    hist->indexed = true;
+    if (hist->map == NULL) {
+        return;
+    }
+    mapEnd = hist->map + hist->mapSize;
+    record = hist->map;
+
+    // Counts the complete records so the entries are allocated once
+    for (end = record; (end = memchr(end, '\n', mapEnd - end)) != NULL; end++) {
+        lines++;
+    }
+    if (lines == 0) {
+        return;
+    }
+    hist->logEntries = malloc(lines * sizeof(struct historyEntry));
+
+    // Parses each record. A partial record at the end of the log is skipped
+    while ((end = memchr(record, '\n', mapEnd - record)) != NULL) {
+        if (parseHistoryRecord(record, end, &hist->logEntries[count])) {
+            count++;
+        }
+        record = end + 1;
+    }
+    hist->logCount = count;
+    if (count == 0) {
+        return;
+    }
+
+    // Sorts the entry numbers by command text
+    hist->sorted = malloc(count * sizeof(long));
+    for (long i = 0; i < count; i++) {
+        hist->sorted[i] = i;
+    }
+    qsort_r(hist->sorted, count, sizeof(long), compareHistoryEntries, hist->logEntries);
+
+    // Leaves of the tree are at count..2*count-1, parents hold the max of their children
+    hist->newestTree = malloc(2 * count * sizeof(long));
+    for (long i = 0; i < count; i++) {
+        hist->newestTree[count + i] = hist->sorted[i];
+    }
+    for (long i = count - 1; i > 0; i--) {
+        long left = hist->newestTree[2 * i];
+        long right = hist->newestTree[2 * i + 1];
+        hist->newestTree[i] = left > right ? left : right;
+    }
+}
+
+/*
+* Finds the range [*low, *high) of the sorted index whose commands
+* begin with prefix
+*/
+void findPrefixRange(struct history *hist, const char *prefix, size_t prefixLength, long *low, long *high) {
+    long left = 0;
+    long right = hist->logCount;
+    long middle;
+
+    // First entry that is not before the prefix
+    while (left < right) {
+        middle = left + (right - left) / 2;
+        if (comparePrefix(&hist->logEntries[hist->sorted[middle]], prefix, prefixLength) < 0) {
+            left = middle + 1;
+        } else {
+            right = middle;
+        }
+    }
+    *low = left;
+
+    // First entry that is after the prefix
+    right = hist->logCount;
+    while (left < right) {
+        middle = left + (right - left) / 2;
+        if (comparePrefix(&hist->logEntries[hist->sorted[middle]], prefix, prefixLength) <= 0) {
+            left = middle + 1;
+        } else {
+            right = middle;
+        }
+    }
+    *high = left;
+}
+
+/*
+* Returns the most recent entry whose command begins with prefix,
+* or NULL if there is none
+*/
+struct historyEntry *findHistory(struct history *hist, const char *prefix, size_t prefixLength) {
+    long low;
+    long high;
+    long newest = -1;
+
+    // Entries from this session are newer than anything in the log
+    for (long i = hist->sessionCount - 1; i >= 0; i--) {
+        if (comparePrefix(&hist->sessionEntries[i], prefix, prefixLength) == 0) {
+            return &hist->sessionEntries[i];
+        }
+    }
+
+    indexHistory(hist);
+    findPrefixRange(hist, prefix, prefixLength, &low, &high);
+
+    // Queries the segment tree for the max entry number in [low, high)
+    for (low += hist->logCount, high += hist->logCount; low < high; low /= 2, high /= 2) {
+        if (low & 1) {
+            if (hist->newestTree[low] > newest) {
+                newest = hist->newestTree[low];
+            }
+            low++;
+        }
+        if (high & 1) {
+            high--;
+            if (hist->newestTree[high] > newest) {
+                newest = hist->newestTree[high];
+            }
+        }
+    }
+
+    if (newest == -1) {
+        return NULL;
+    }
+    return &hist->logEntries[newest];
+}
+
+/*
+* Appends a command to the history. The record is written to the log
+* with a single write so that concurrent shells do not interleave
+*/
+void addHistory(struct history *hist, char *line, long startTime, long durationMs, int status) {
+    char record[2200];
+    size_t length = strcspn(line, "\n");
+    struct historyEntry *entry;
+    int recordLength = snprintf(record, sizeof(record), "%ld\t%ld\t%d\t%.*s\n",
+                                startTime, durationMs, status, (int) length, line);
+
+    // Keeps the record terminated if the command was too long
+    if (recordLength >= (int) sizeof(record)) {
+        recordLength = sizeof(record) - 1;
+        record[recordLength - 1] = '\n';
+    }
+    if (hist->fd != -1) {
+        if (write(hist->fd, record, recordLength) == -1) {
+            perror("history");
+            fflush(stdout);
+        } else {
+            hist->logSize += recordLength;
+        }
+    }
+
+    // Grows the session entries by doubling
+    if (hist->sessionCount == hist->sessionCapacity) {
+        hist->sessionCapacity = hist->sessionCapacity == 0 ? 64 : hist->sessionCapacity * 2;
+        hist->sessionEntries = realloc(hist->sessionEntries,
+                                       hist->sessionCapacity * sizeof(struct historyEntry));
+    }
+    entry = &hist->sessionEntries[hist->sessionCount];
+    entry->line = strndup(line, length);
+    entry->length = length;
+    entry->startTime = startTime;
+    entry->durationMs = durationMs;
+    entry->exitStatus = status;
+    hist->sessionCount++;
+}
+
+/*
+* Prints a single history entry with its number
+*/
+void printHistoryEntry(long number, struct historyEntry *entry) {
+    char timeString[32];
+    time_t startTime = entry->startTime;
+    struct tm timeInfo;
+
+    localtime_r(&startTime, &timeInfo);
+    strftime(timeString, sizeof(timeString), "%Y-%m-%d %H:%M:%S", &timeInfo);
+    printf("%6ld  %s  %6ldms  exit %-3d  %.*s\n", number, timeString, entry->durationMs,
+           entry->exitStatus, (int) entry->length, entry->line);
+}
+
+/* Orders entry numbers from oldest to newest */
+int compareEntryNumbers(const void *a, const void *b) {
+    long first = *(const long *) a;
+    long second = *(const long *) b;
+    return (first > second) - (first < second);
+}
+
+/*
+* Handles the history command. With no arguments every entry is printed.
+* history -p prefix prints only the entries beginning with prefix.
+* Returns 1 on a usage error and 0 otherwise
+*/
+int runHistory(struct history *hist, struct commandLine *cmdLine) {
+    char *prefix;
+    size_t prefixLength;
+    long low;
+    long high;
+
+    indexHistory(hist);
+
+    if (cmdLine->argv[0] == NULL) {
+        for (long i = 0; i < hist->logCount; i++) {
+            printHistoryEntry(i + 1, &hist->logEntries[i]);
+        }
+        for (long i = 0; i < hist->sessionCount; i++) {
+            printHistoryEntry(hist->logCount + i + 1, &hist->sessionEntries[i]);
+        }
+    } else if (strcmp(cmdLine->argv[0], "-p") == 0) {
+        prefix = cmdLine->argv[1] != NULL ? cmdLine->argv[1] : "";
+        prefixLength = strlen(prefix);
+
+        // Copies the matching range and puts it back in the order it was run
+        findPrefixRange(hist, prefix, prefixLength, &low, &high);
+        if (high > low) {
+            long *matches = malloc((high - low) * sizeof(long));
+            memcpy(matches, &hist->sorted[low], (high - low) * sizeof(long));
+            qsort(matches, high - low, sizeof(long), compareEntryNumbers);
+            for (long i = 0; i < high - low; i++) {
+                printHistoryEntry(matches[i] + 1, &hist->logEntries[matches[i]]);
+            }
+            free(matches);
+        }
+        for (long i = 0; i < hist->sessionCount; i++) {
+            if (comparePrefix(&hist->sessionEntries[i], prefix, prefixLength) == 0) {
+                printHistoryEntry(hist->logCount + i + 1, &hist->sessionEntries[i]);
+            }
+        }
+    } else {
+        printf("history: usage: history [-p prefix]\n");
+        fflush(stdout);
+        return 1;
+    }
+    fflush(stdout);
+    return 0;
+}
+
+/*
+* Replaces a !prefix input line with the most recent command beginning
+* with prefix. Returns false if no command matches or the matching
+* command is too long to fit in the input line
+*/
+bool recallHistory(struct history *hist, char *inputLine, int lineSize) {
+    char *prefix = inputLine + 1;
+    size_t prefixLength = strcspn(prefix, "\n");
+    struct historyEntry *entry = findHistory(hist, prefix, prefixLength);
+
+    if (entry == NULL) {
+        printf("!%.*s: event not found\n", (int) prefixLength, prefix);
+        fflush(stdout);
+        return false;
+    }
+    // Room is needed for the newline and null terminator
+    if (entry->length >= (size_t) lineSize - 1) {
+        printf("!%.*s: event too long\n", (int) prefixLength, prefix);
+        fflush(stdout);
+        return false;
+    }
+
+    // Echoes the recalled command like other shells do
+    snprintf(inputLine, lineSize, "%.*s\n", (int) entry->length, entry->line);
+    printf("%s", inputLine);
+    fflush(stdout);
+    return true;
+}
+
+/*
+* Releases the mapping, the index and the session entries
+*/
+void closeHistory(struct history *hist) {
+    if (hist->map != NULL) {
+        munmap(hist->map, hist->mapSize);
+    }
+    if (hist->fd != -1) {
+        close(hist->fd);
+    }
+    for (long i = 0; i < hist->sessionCount; i++) {
+        free((char *) hist->sessionEntries[i].line);
+    }
+    free(hist->sessionEntries);
+    free(hist->logEntries);
+    free(hist->sorted);
+    free(hist->newestTree);
+}
+
+/* Returns the milliseconds elapsed since start */
+long elapsedMs(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
 int main(int argc, char *argv[]){
     // Sets max size of command line to be 2048 + 1 for null ptr
     int lineSize = 2049;
@@ -584,6 +1073,11 @@ int main(int argc, char *argv[]){
     int bgID[513];
     int status = 0;
     int childID[1000];
+    struct history hist;
+    struct timespec commandStart;
+    long startTime;
+    long durationMs;
+    int commandStatus;
 
     // Initialize array for bgID with dummy variable
     for (int i = 0; i < 513; i++) {
@@ -615,6 +1109,9 @@ int main(int argc, char *argv[]){
     // Registers the handler for SIGTSTP
     sigaction(SIGTSTP, &SIGTSTP_action, NULL);
 
+    // Maps the history log from previous sessions
+    openHistory(&hist);
+
     // // Command line loop for smallsh 
     do {
         // Prints the colon prompt and grabs input from user
@@ -624,41 +1121,72 @@ int main(int argc, char *argv[]){
         inputLine = calloc(lineSize,sizeof(char));
         // Reads the user input from keyboard into input line
         fgets(inputLine, lineSize, stdin);
+
+        // Replaces !prefix with the most recent matching command
+        if (*inputLine == '!' && !recallHistory(&hist, inputLine, lineSize)) {
+            free(inputLine);
+            inputLine = NULL;
+            reapBackground(bgID);
+            continue;
+        }
+        startTime = time(NULL);
+        clock_gettime(CLOCK_MONOTONIC, &commandStart);
         
         // Returns to the command line prompt when user enters comment or blank line or exit
         if ((strcmp(inputLine, "\n") == 0) || *inputLine == '#' || strcmp(inputLine, "exit\n") == 0) {
+            // exit is still recorded in the history
+            if (strcmp(inputLine, "exit\n") == 0) {
+                addHistory(&hist, inputLine, startTime, 0, 0);
+            }
             reapBackground(bgID);
             continue;
         }
 
+        // Saves the line before it is expanded and tokenized for the history
+        char* historyLine = strdup(inputLine);
+
         // Expands the $$ instances
         char* parsedInputLine = variableExpansion(inputLine);
         // Parses the variable expanded command line input
         struct commandLine *cmdLine = parseCommandLine(parsedInputLine);
 
+        // Result of this command alone, recorded in the history
+        commandStatus = 0;
+
         //Executes the the non built in commands 
         if (nonBuiltCommand(cmdLine)) {
-            runCommand(cmdLine, bgID, childID, &status, &handle_SIGTSTP);
+            commandStatus = runCommand(cmdLine, bgID, childID, &status, &handle_SIGTSTP);
         }
 
         // Handles the cd command
         if (strcmp(cmdLine->command, "cd") == 0) {
-            cdToPath(cmdLine->argv[0]);
+            commandStatus = cdToPath(cmdLine->argv[0]);
         }
         // Handles the status command
         if (strcmp(cmdLine->command, "status") == 0) {
             printStatus(status);
         }
+        // Handles the history command
+        if (strcmp(cmdLine->command, "history") == 0) {
+            commandStatus = runHistory(&hist, cmdLine);
+        }
+
+        // Records the command with how long it took and its own status.
+        // Background commands are still running so both are recorded as -1
+        durationMs = commandStatus == -1 ? -1 : elapsedMs(&commandStart);
+        addHistory(&hist, historyLine, startTime, durationMs, commandStatus);
+        free(historyLine);
 
         // Frees allocated memory on the heap
         freeCommandStruct(cmdLine);
         free(inputLine);
         reapBackground(bgID);
 
-    } while (strcmp(inputLine, "exit\n") != 0);
+    } while (inputLine == NULL || strcmp(inputLine, "exit\n") != 0);
     
     // Reaps all remaining child processes created by the shell
     reapChildProcess(childID);
+    closeHistory(&hist);
 
     exit(EXIT_SUCCESS);
 }